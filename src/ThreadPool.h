@@ -0,0 +1,221 @@
+#pragma once
+#include "Common.h"
+
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dm {
+
+// persistent worker pool, runs one parallelFor at a time.
+// each worker owns a deque of index ranges:
+    // owner pops from the back, splitting big ranges in half and pushing the upper half back
+    // idle workers steal from the front of others' deques, i.e. the biggest remaining ranges
+// so chunks shrink only where there is contention, and slow workers are drained by fast ones.
+class ThreadPool
+{
+public:
+    // fn(begin, end, worker_id)
+    using Task = std::function<void(uint64_t, uint64_t, uint32_t)>;
+
+    struct WorkerStats
+    {
+        uint64_t    mBusyNs = 0;
+        uint64_t    mItems = 0;
+        uint64_t    mChunks = 0;
+        uint64_t    mSteals = 0;    // ranges this worker stole from others
+    };
+
+private:
+    struct Range
+    {
+        uint64_t    mBegin;
+        uint64_t    mEnd;
+    };
+
+    struct alignas(64) Worker
+    {
+        std::mutex          mLock;
+        std::deque<Range>   mRanges;
+
+        WorkerStats         mStats;     // only touched by the worker itself during a job
+    };
+
+    std::vector<Worker *>       mWorkers;
+    std::vector<std::thread>    mThreads;
+
+    // job state, guarded by mLock
+    std::mutex              mLock;
+    std::condition_variable mCond;      // wakes workers for a new job or stop
+    std::condition_variable mDoneCond;  // wakes parallelFor when all workers are back
+    uint64_t    mGeneration = 0;
+    uint32_t    mRunning = 0;
+    bool        mStopped = false;
+
+    Task        mTask;
+    uint32_t    mJobWorkers = 0;
+    uint64_t    mGrain = 1;
+
+    uint64_t    mJobNs = 0;
+
+public:
+    ThreadPool(uint32_t n_workers)
+    {
+        assert(n_workers > 0);
+        for (uint32_t i = 0; i < n_workers; i++) {
+            mWorkers.emplace_back(new Worker());
+        }
+        for (uint32_t i = 0; i < n_workers; i++) {
+            mThreads.emplace_back([this, i]() { workerLoop(i); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard lock(mLock);
+            mStopped = true;
+        }
+        mCond.notify_all();
+        for (auto &thread : mThreads) {
+            thread.join();
+        }
+        for (auto worker : mWorkers) {
+            delete worker;
+        }
+    }
+
+    // run task over [0, n) on the first n_workers workers and wait for it.
+    // grain is the smallest chunk a range is split into, 0 picks one from n.
+    void parallelFor(uint64_t n, uint32_t n_workers, Task task, uint64_t grain = 0)
+    {
+        assert(n_workers > 0 && n_workers <= mWorkers.size());
+        if unlikely(n == 0) {
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        // seed each worker with a contiguous slice, stealing balances the rest
+        for (uint32_t i = 0; i < n_workers; i++)
+        {
+            Worker *worker = mWorkers[i];
+            worker->mStats = WorkerStats{};
+            std::lock_guard lock(worker->mLock);
+            worker->mRanges.clear();
+            worker->mRanges.push_back(Range{n * i / n_workers, n * (i + 1) / n_workers});
+        }
+
+        std::unique_lock lock(mLock);
+        mTask = std::move(task);
+        mJobWorkers = n_workers;
+        mGrain = grain ? grain : std::max<uint64_t>(1, n / (n_workers * 64ull));
+        mRunning = mWorkers.size();
+        ++mGeneration;
+        mCond.notify_all();
+
+        mDoneCond.wait(lock, [&]() { return mRunning == 0; });
+        mTask = nullptr;
+        mJobNs = (std::chrono::steady_clock::now() - start).count();
+    }
+
+    // per-worker utilization and steals of the last parallelFor
+    void printStats(std::ostream &os) const
+    {
+        for (uint32_t i = 0; i < mJobWorkers; i++)
+        {
+            auto &stats = mWorkers[i]->mStats;
+            os << "    worker " << i << ": util " << (mJobNs ? stats.mBusyNs * 100. / mJobNs : 0.) << "%"
+               << ", items " << stats.mItems << ", chunks " << stats.mChunks << ", steals " << stats.mSteals << "\n";
+        }
+    }
+
+private:
+    void workerLoop(uint32_t worker_id)
+    {
+        uint64_t seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock lock(mLock);
+                mCond.wait(lock, [&]() { return mStopped || mGeneration != seen; });
+                if (mStopped) {
+                    return;
+                }
+                seen = mGeneration;
+            }
+
+            if (worker_id < mJobWorkers) {
+                runJob(worker_id);
+            }
+
+            std::lock_guard lock(mLock);
+            if (--mRunning == 0) {
+                mDoneCond.notify_one();
+            }
+        }
+    }
+
+    void runJob(uint32_t worker_id)
+    {
+        Worker *self = mWorkers[worker_id];
+        Range range;
+        // only owners push ranges, so once every deque is seen empty no work is left for us.
+        // leave instead of spinning, so preempted workers holding the last chunks get the cpu.
+        while (popLocal(self, range) || steal(worker_id, range))
+        {
+            // lazy split: keep the lower half, leave the upper half for us or thieves
+            while (range.mEnd - range.mBegin > mGrain)
+            {
+                uint64_t mid = range.mBegin + (range.mEnd - range.mBegin) / 2;
+                std::lock_guard lock(self->mLock);
+                self->mRanges.push_back(Range{mid, range.mEnd});
+                range.mEnd = mid;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            mTask(range.mBegin, range.mEnd, worker_id);
+            self->mStats.mBusyNs += (std::chrono::steady_clock::now() - start).count();
+
+            self->mStats.mItems += range.mEnd - range.mBegin;
+            ++self->mStats.mChunks;
+        }
+    }
+
+    bool popLocal(Worker *self, Range &range)
+    {
+        std::lock_guard lock(self->mLock);
+        if (self->mRanges.empty()) {
+            return false;
+        }
+        range = self->mRanges.back();
+        self->mRanges.pop_back();
+        return true;
+    }
+
+    bool steal(uint32_t worker_id, Range &range)
+    {
+        for (uint32_t i = 1; i < mJobWorkers; i++)
+        {
+            Worker *victim = mWorkers[(worker_id + i) % mJobWorkers];
+            std::lock_guard lock(victim->mLock);
+            if (victim->mRanges.empty()) {
+                continue;
+            }
+            range = victim->mRanges.front();
+            victim->mRanges.pop_front();
+            ++mWorkers[worker_id]->mStats.mSteals;
+            return true;
+        }
+        return false;
+    }
+};
+
+}   // end of namespace dm
@@ -0,0 +1,469 @@
+#pragma once
+#include "Common.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dm {
+
+enum class WalMode
+{
+    Off,
+    Buffered,   // group write(), leave durability to the page cache
+    Synced,     // group write() + fdatasync() per flush round
+};
+
+// append-only wal for inserts
+// each insert thread owns a log file and a pair of buffers:
+    // insert appends records into the active buffer (only contends with the flusher)
+    // the flusher thread swaps out active buffers and writes them in batch,
+    // then fdatasync every touched file once per round if synced
+// recovery replays each log file in its own thread.
+//
+// record layout: | key size (4B) | checksum (4B) | value (8B) | key |
+// a torn tail record fails the checksum and ends replay of that log.
+//
+// `wal.meta` records the number of logs of the run that wrote them,
+// so logs from a run with different parallelism are rejected instead of mixed in.
+class WriteAheadLog
+{
+private:
+    struct RecordHeader
+    {
+        uint32_t    mKeySize;
+        uint32_t    mChecksum;
+        uint64_t    mValue;
+    };
+
+    struct alignas(64) LogBuffer
+    {
+        std::mutex              mLock;
+        std::condition_variable mCond;  // wakes writers blocked on a full buffer
+
+        std::vector<char>   mActive;    // guarded by mLock
+        std::vector<char>   mFlushing;  // owned by the flusher
+
+        uint64_t    mAppended = 0;      // bytes, guarded by mLock
+        std::atomic<uint64_t>   mDurable{0};    // bytes written (and synced if synced)
+
+        int     mFd = -1;
+    };
+
+    const WalMode   mMode;
+    const uint32_t  mBufferSize;
+
+    std::string     mDir;
+
+    std::vector<LogBuffer *>    mLogs;
+
+    // flusher state
+    std::mutex              mFlushLock;
+    std::condition_variable mFlushCond; // wakes the flusher
+    std::condition_variable mDoneCond;  // wakes sync() waiters
+    bool    mFlushRequested = false;
+    bool    mStopped = false;
+
+    std::thread     mFlusher;
+
+    // keep replayed logs alive across recover() calls, recovered keys point into them
+    std::vector<std::vector<char>>  mRecovered;
+
+public:
+    // `truncate` drops all existing logs, otherwise new records go after them,
+    // which requires the logs to come from a run with the same n_thrds.
+    WriteAheadLog(const std::string &dir, uint32_t n_thrds, WalMode mode,
+                  bool truncate = true, uint32_t buffer_size = 1024 * 1024)
+    : mMode(mode)
+    , mBufferSize(buffer_size)
+    , mDir(dir)
+    {
+        assert(mode != WalMode::Off);
+        mkdir(mDir.c_str(), 0755);
+
+        if (truncate)
+        {
+            // drop the meta first, a crash in between leaves no claim on half-removed logs
+            unlink(getMetaPath().c_str());
+            for (auto idx : listLogs())
+            {
+                if (idx >= n_thrds) {
+                    unlink(getLogPath(idx).c_str());
+                }
+            }
+        }
+        else
+        {
+            int64_t last_thrds = readMeta();
+            if unlikely(last_thrds < 0 ? !listLogs().empty() : last_thrds != n_thrds)
+            {
+                std::cerr << "wal " << mDir << " was written by " << (last_thrds < 0 ? std::string("an unknown number of") : std::to_string(last_thrds))
+                          << " threads, recover with the same parallelism as the last run\n";
+                exit(1);
+            }
+        }
+
+        for (uint32_t i = 0; i < n_thrds; i++)
+        {
+            auto log = mLogs.emplace_back(new LogBuffer());
+            log->mActive.reserve(mBufferSize);
+            log->mFlushing.reserve(mBufferSize);
+
+            int flags = O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0);
+            log->mFd = open(getLogPath(i).c_str(), flags, 0644);
+            if unlikely(log->mFd < 0)
+            {
+                std::cerr << "failed to open wal " << getLogPath(i) << ": " << strerror(errno) << "\n";
+                exit(1);
+            }
+        }
+        writeMeta(n_thrds);
+
+        mFlusher = std::thread([this]() { flushLoop(); });
+    }
+
+    ~WriteAheadLog()
+    {
+        sync();
+        {
+            std::lock_guard lock(mFlushLock);
+            mStopped = true;
+        }
+        mFlushCond.notify_one();
+        mFlusher.join();
+
+        for (auto log : mLogs)
+        {
+            close(log->mFd);
+            delete log;
+        }
+    }
+
+    void append(const std::string_view &key, uint64_t value, uint32_t thrd_id)
+    {
+        assert(thrd_id < mLogs.size());
+        LogBuffer *log = mLogs[thrd_id];
+
+        RecordHeader header{(uint32_t)key.size(), checksum(key, value), value};
+        uint32_t size = sizeof(header) + key.size();
+
+        std::unique_lock lock(log->mLock);
+        if unlikely(log->mActive.size() + size > mBufferSize && !log->mActive.empty())
+        {
+            // back pressure: wait for the flusher to take the full buffer
+            requestFlush();
+            log->mCond.wait(lock, [&]() { return log->mActive.size() + size <= mBufferSize || log->mActive.empty(); });
+        }
+
+        auto pos = log->mActive.size();
+        log->mActive.resize(pos + size);
+        memcpy(log->mActive.data() + pos, &header, sizeof(header));
+        memcpy(log->mActive.data() + pos + sizeof(header), key.data(), key.size());
+        log->mAppended += size;
+    }
+
+    // wait until every record appended before this call is written (and synced if synced)
+    void sync()
+    {
+        std::vector<uint64_t> targets(mLogs.size());
+        for (uint32_t i = 0; i < mLogs.size(); i++)
+        {
+            std::lock_guard lock(mLogs[i]->mLock);
+            targets[i] = mLogs[i]->mAppended;
+        }
+
+        std::unique_lock lock(mFlushLock);
+        mFlushRequested = true;
+        mFlushCond.notify_one();
+        mDoneCond.wait(lock, [&]()
+        {
+            for (uint32_t i = 0; i < mLogs.size(); i++)
+            {
+                if (mLogs[i]->mDurable.load(std::memory_order_acquire) < targets[i]) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+
+    // replay all logs in parallel, log i is applied with thrd_id i.
+    // apply(key, value, thrd_id) must be thread safe, keys stay valid while the wal lives.
+    // records appended before this call are flushed first and included.
+    // a torn tail is cut off so that new records are appended right after the last valid one.
+    // returns the number of replayed records.
+    template <class Apply>
+    uint64_t recover(Apply &&apply)
+    {
+        sync();
+
+        size_t base = mRecovered.size();
+        mRecovered.resize(base + mLogs.size());
+
+        std::atomic<uint64_t> n_records{0};
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < mLogs.size(); i++)
+        {
+            threads.emplace_back([&, i]()
+            {
+                auto &data = mRecovered[base + i];
+                if (!readLog(getLogPath(i), data)) {
+                    return;
+                }
+
+                uint64_t n = 0;
+                size_t pos = 0;
+                RecordHeader header;
+                while (pos + sizeof(header) <= data.size())
+                {
+                    memcpy(&header, data.data() + pos, sizeof(header));
+                    if (pos + sizeof(header) + header.mKeySize > data.size()) {
+                        break;
+                    }
+                    std::string_view key(data.data() + pos + sizeof(header), header.mKeySize);
+                    if (checksum(key, header.mValue) != header.mChecksum) {
+                        break;
+                    }
+
+                    apply(key, header.mValue, i);
+                    pos += sizeof(header) + header.mKeySize;
+                    ++n;
+                }
+
+                if unlikely(pos != data.size())
+                {
+                    std::cerr << "wal " << getLogPath(i) << ": dropped " << data.size() - pos << " bytes of torn tail\n";
+                    if (ftruncate(mLogs[i]->mFd, pos) != 0)
+                    {
+                        std::cerr << "truncate wal " << getLogPath(i) << " failed: " << strerror(errno) << "\n";
+                        exit(1);
+                    }
+                }
+                n_records += n;
+            });
+        }
+
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        return n_records;
+    }
+
+private:
+    std::string getLogPath(uint32_t idx) const
+    {
+        return mDir + "/wal." + std::to_string(idx) + ".log";
+    }
+
+    std::string getMetaPath() const
+    {
+        return mDir + "/wal.meta";
+    }
+
+    // indexes of all `wal.N.log` in the directory
+    std::vector<uint32_t> listLogs() const
+    {
+        std::vector<uint32_t> idxs;
+        DIR *dir = opendir(mDir.c_str());
+        if (!dir) {
+            return idxs;
+        }
+        while (auto entry = readdir(dir))
+        {
+            uint32_t idx;
+            int len = 0;
+            if (sscanf(entry->d_name, "wal.%u.log%n", &idx, &len) == 1 && entry->d_name[len] == 0) {
+                idxs.push_back(idx);
+            }
+        }
+        closedir(dir);
+        return idxs;
+    }
+
+    // number of threads of the run that wrote the logs, -1 if unknown
+    int64_t readMeta() const
+    {
+        std::vector<char> data;
+        if (!readLog(getMetaPath(), data)) {
+            return -1;
+        }
+        data.push_back(0);
+        uint32_t n_thrds;
+        if (sscanf(data.data(), "threads %u", &n_thrds) != 1) {
+            return -1;
+        }
+        return n_thrds;
+    }
+
+    void writeMeta(uint32_t n_thrds)
+    {
+        std::string tmp_path = getMetaPath() + ".tmp";
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if unlikely(fd < 0)
+        {
+            std::cerr << "failed to open wal meta " << tmp_path << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
+        std::string data = "threads " + std::to_string(n_thrds) + "\n";
+        writeAll(fd, std::vector<char>(data.begin(), data.end()));
+        if unlikely(fsync(fd) != 0 || rename(tmp_path.c_str(), getMetaPath().c_str()) != 0)
+        {
+            std::cerr << "failed to write wal meta " << getMetaPath() << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
+        close(fd);
+    }
+
+    void requestFlush()
+    {
+        std::lock_guard lock(mFlushLock);
+        mFlushRequested = true;
+        mFlushCond.notify_one();
+    }
+
+    void flushLoop()
+    {
+        while (true)
+        {
+            {
+                std::unique_lock lock(mFlushLock);
+                // group commit window: flush every 1ms or when asked
+                mFlushCond.wait_for(lock, std::chrono::milliseconds(1), [&]() { return mFlushRequested || mStopped; });
+                if (mStopped) {
+                    return;
+                }
+                mFlushRequested = false;
+            }
+
+            flushRound();
+
+            std::lock_guard lock(mFlushLock);
+            mDoneCond.notify_all();
+        }
+    }
+
+    void flushRound()
+    {
+        std::vector<uint64_t> appended(mLogs.size());
+        std::vector<bool> dirty(mLogs.size(), false);
+
+        // 1. take all active buffers, writers continue on the spare one
+        for (uint32_t i = 0; i < mLogs.size(); i++)
+        {
+            LogBuffer *log = mLogs[i];
+            {
+                std::lock_guard lock(log->mLock);
+                if (log->mActive.empty()) {
+                    continue;
+                }
+                log->mActive.swap(log->mFlushing);
+                appended[i] = log->mAppended;
+            }
+            log->mCond.notify_all();
+            dirty[i] = true;
+        }
+
+        // 2. one write per log
+        for (uint32_t i = 0; i < mLogs.size(); i++)
+        {
+            if (dirty[i]) {
+                writeAll(mLogs[i]->mFd, mLogs[i]->mFlushing);
+                mLogs[i]->mFlushing.clear();
+            }
+        }
+
+        // 3. one fdatasync per log
+        for (uint32_t i = 0; i < mLogs.size(); i++)
+        {
+            if (!dirty[i]) {
+                continue;
+            }
+            if (mMode == WalMode::Synced && unlikely(fdatasync(mLogs[i]->mFd) != 0))
+            {
+                std::cerr << "fdatasync wal " << getLogPath(i) << " failed: " << strerror(errno) << "\n";
+                exit(1);
+            }
+            mLogs[i]->mDurable.store(appended[i], std::memory_order_release);
+        }
+    }
+
+    void writeAll(int fd, const std::vector<char> &data)
+    {
+        size_t pos = 0;
+        while (pos < data.size())
+        {
+            ssize_t rslt = write(fd, data.data() + pos, data.size() - pos);
+            if unlikely(rslt < 0)
+            {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "write wal failed: " << strerror(errno) << "\n";
+                exit(1);
+            }
+            pos += rslt;
+        }
+    }
+
+    static bool readLog(const std::string &path, std::vector<char> &data)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if unlikely(fstat(fd, &st) != 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        data.resize(st.st_size);
+        size_t pos = 0;
+        while (pos < data.size())
+        {
+            ssize_t rslt = read(fd, data.data() + pos, data.size() - pos);
+            if (rslt < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rslt <= 0) {
+                break;
+            }
+            pos += rslt;
+        }
+        data.resize(pos);
+        close(fd);
+        return true;
+    }
+
+    // fnv-1a over key and value
+    static uint32_t checksum(const std::string_view &key, uint64_t value)
+    {
+        uint32_t hash = 2166136261u;
+        for (char c : key) {
+            hash = (hash ^ (uint8_t)c) * 16777619u;
+        }
+        for (uint32_t i = 0; i < sizeof(value); i++) {
+            hash = (hash ^ (uint8_t)(value >> (i * 8))) * 16777619u;
+        }
+        return hash;
+    }
+};
+
+}   // end of namespace dm
@@ -1,11 +1,12 @@
 #include "RequestGenerator.h"
 #include "SkipListV1.h"
+#include "ThreadPool.h"
+#include "WriteAheadLog.h"
 
 #include "argparse/argparse.hpp"
 
 #include <chrono>
 #include <cstdint>
-#include <thread>
 
 using namespace dm;
 
@@ -26,6 +27,19 @@ int main(int argc, char *argv[])
         .scan<'i', uint32_t>()
         .default_value(16u);
 
+    program.add_argument("--wal")
+        .help("write-ahead log for inserts: off, buffered or synced")
+        .default_value(std::string("off"))
+        .choices("off", "buffered", "synced");
+
+    program.add_argument("--wal_dir")
+        .help("directory of wal files")
+        .default_value(std::string("./wal"));
+
+    program.add_argument("--wal_recover")
+        .help("keep the existing wal, replay it before inserting and verify the whole wal after queries")
+        .flag();
+
     try {
         program.parse_args(argc, argv);
     }
@@ -38,6 +52,23 @@ int main(int argc, char *argv[])
     uint32_t parallel = program.get<uint32_t>("--parallel");
     uint32_t query_parallel = program.get<uint32_t>("--query_parallel");
 
+    auto wal_name = program.get<std::string>("--wal");
+    WalMode wal_mode = wal_name == "synced" ? WalMode::Synced
+                     : wal_name == "buffered" ? WalMode::Buffered
+                     : WalMode::Off;
+    bool wal_recover = program.get<bool>("--wal_recover");
+    if (wal_recover && wal_mode == WalMode::Off)
+    {
+        std::cerr << "--wal_recover needs --wal buffered or synced\n";
+        std::exit(1);
+    }
+
+    WriteAheadLog *wal = nullptr;
+    if (wal_mode != WalMode::Off) {
+        // on restart, keep the logs of the last run and append after them
+        wal = new WriteAheadLog(program.get<std::string>("--wal_dir"), parallel, wal_mode, !wal_recover/*truncate*/);
+    }
+
     // insert
     uint32_t entries_per_thread = total_entries / parallel;
     uint32_t remainder = total_entries % parallel;
@@ -52,70 +83,108 @@ int main(int argc, char *argv[])
         req_gens.emplace_back(new RequestGenerator(n_entries, i));
     }
 
-    std::vector<std::thread> threads;
+    // restart: replay the last run's logs before new inserts
+    uint64_t n_restored = 0;
+    if (wal_recover)
+    {
+        auto restore_start = std::chrono::steady_clock::now();
+        n_restored = wal->recover([&](const std::string_view &key, uint64_t value, uint32_t thrd_id)
+        {
+            skiplist.insert(key, value, thrd_id);
+        });
+        auto restore_end = std::chrono::steady_clock::now();
+        std::cout << "restore " << n_restored << " entries from wal with " << parallel << " threads cost " << (restore_end - restore_start).count() / 1000000. << "ms.\n";
+    }
+
+    // workers are created before timing and reused by both phases
+    ThreadPool pool(std::max(parallel, query_parallel));
+    // one cache line per worker, rand() writes its state on every query
+    struct alignas(64) QueryRandom
+    {
+        RNG     mRandom;
+    };
+    std::vector<QueryRandom> query_randoms(query_parallel);
 
     std::cout << "start insert entries.\n";
     auto insert_start = std::chrono::steady_clock::now();
 
-    uint32_t entries_offset = 0;
-    for (uint32_t i = 0; i < parallel; i++)
+    // a chunk runs on whichever worker took it, so it uses that worker's generator, memory and log
+    pool.parallelFor(total_entries, parallel, [&](uint64_t begin, uint64_t end, uint32_t worker_id)
     {
-        uint32_t n_entries = entries_per_thread + (i < remainder ? 1 : 0);
-        threads.emplace_back([&, i, entries_offset, n_entries]()
+        for (uint64_t j = begin; j < end; j++)
         {
-            for (uint32_t j = 0; j < n_entries; j++)
-            {
-                req_gens[i]->generateRequest();
-                // req_gens[i]->generateRequest2();
-                skiplist.insert(req_gens[i]->mKey, req_gens[i]->mValue, i);
-                keys[entries_offset + j] = req_gens[i]->mKey;
+            req_gens[worker_id]->generateRequest();
+            // req_gens[worker_id]->generateRequest2();
+            if (wal) {
+                wal->append(req_gens[worker_id]->mKey, req_gens[worker_id]->mValue, worker_id);
             }
-        });
-        entries_offset += n_entries;
-    }
-
-    for (uint32_t i = 0; i < parallel; i++)
-    {
-        threads[i].join();
+            skiplist.insert(req_gens[worker_id]->mKey, req_gens[worker_id]->mValue, worker_id);
+            keys[j] = req_gens[worker_id]->mKey;
+        }
+    });
+    if (wal) {
+        wal->sync();
     }
 
     auto insert_end = std::chrono::steady_clock::now();
-    std::cout << "insert " << total_entries << " entries with " << parallel << " threads cost " << (insert_end - insert_start).count() / 1000000. << "ms.\n";
+    double insert_ms = (insert_end - insert_start).count() / 1000000.;
+    std::cout << "insert " << total_entries << " entries with " << parallel << " threads (wal " << wal_name << ") cost " << insert_ms << "ms, "
+              << total_entries / insert_ms / 1000. << " Mops/s.\n";
+    pool.printStats(std::cout);
 
     // skiplist.checkBottom();
 
     // query
-    threads.clear();
-
-    uint32_t queries_per_thread = total_queries / query_parallel;
-    remainder = total_queries % query_parallel;
     auto query_start = std::chrono::steady_clock::now();
 
-    for (uint32_t i = 0; i < query_parallel; i++)
+    pool.parallelFor(total_queries, query_parallel, [&](uint64_t begin, uint64_t end, uint32_t worker_id)
     {
-        uint32_t n_queries = queries_per_thread + (i < remainder ? 1 : 0);
-        threads.emplace_back([&, n_queries]()
+        RNG &random = query_randoms[worker_id].mRandom;
+        volatile uint64_t value;
+        for (uint64_t j = begin; j < end; j++)
         {
-            RNG random;
-            volatile uint64_t value;
-            for (uint32_t j = 0; j < n_queries; j++)
-            {
-                uint32_t idx = random.rand() % total_queries;
-                value = skiplist.find(keys[idx]);
-                // if (j % 11 == 10) {
-                //     std::cout << "finished 10 queries\n";
-                // }
-            }
-        });
-    }
+            uint32_t idx = random.rand() % total_queries;
+            value = skiplist.find(keys[idx]);
+            // if (j % 11 == 10) {
+            //     std::cout << "finished 10 queries\n";
+            // }
+        }
+    });
+
+    auto query_end = std::chrono::steady_clock::now();
+    std::cout << "query " << total_queries << " keys with " << query_parallel << " threads cost " << (query_end - query_start).count() / 1000000. << "ms.\n";
+    pool.printStats(std::cout);
 
-    for (uint32_t i = 0; i < query_parallel; i++)
+    // replay the whole wal (restored + new entries) into a new skiplist, as a restart would
+    if (wal_recover)
     {
-        threads[i].join();
+        SkipListV1<Node<10/*MaxLevel*/>, 50/*NextLevelP*/> recovered(parallel, sizeof(Node<10>) * entries_per_thread + 1);
+
+        auto recover_start = std::chrono::steady_clock::now();
+        uint64_t n_records = wal->recover([&](const std::string_view &key, uint64_t value, uint32_t thrd_id)
+        {
+            recovered.insert(key, value, thrd_id);
+        });
+        auto recover_end = std::chrono::steady_clock::now();
+        std::cout << "recover " << n_records << " entries with " << parallel << " threads cost " << (recover_end - recover_start).count() / 1000000. << "ms.\n";
+
+        if (n_records != n_restored + total_entries)
+        {
+            std::cerr << "recovered " << n_records << " of " << n_restored + total_entries << " entries\n";
+            return 1;
+        }
+        uint64_t stride = std::max<uint64_t>(1, total_entries / total_queries);
+        for (uint64_t i = 0; i < total_entries; i += stride)
+        {
+            if (recovered.find(keys[i]) != skiplist.find(keys[i]))
+            {
+                std::cerr << "recovered value mismatch for key: " << keys[i] << "\n";
+                return 1;
+            }
+        }
     }
 
-    auto query_end = std::chrono::steady_clock::now();
-    std::cout << "query " << total_queries << " keys cost " << (query_end - query_start).count() / 1000000. << "ms.\n";
+    delete wal;
 
     return 0;
 }